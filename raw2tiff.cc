@@ -50,15 +50,63 @@ g++ -D_FILE_OFFSET_BITS=64 -Wall -Wextra -Wno-unused -Wno-parentheses -Wno-unkno
   * This will take the image source.cr2 and generate a tif image-(x4.tif)
   * that has 400 rows and 5202 columns. The image-(x4.tif)-contains image
   * data from source.cr2 starting at row 1900 and column position 0.
+  *
+  * Optional arguments may follow the seven required ones:
+  *
+  * >./raw2tiff source.cr2 ./x4.tif no 0 0 0 0 -stats
+  *
+  * The -stats option writes per-CFA-channel statistics-(histogram, min,
+  * max, mean, saturated and hot pixel counts)-to the sidecar file
+  * x4.tif.json. They are gathered while the tiff rows are extracted so
+  * no second pass over the image is needed.
+  *
+  * Master calibration frames can be applied in the same pass:
+  *
+  * >./raw2tiff source.cr2 ./x4.tif no 0 0 0 0 -dark dark.tif -flat flat.tif
+  *
+  * Both masters are 16 bit tiff images covering the whole sensor, as
+  * written by raw2tiff without a crop box. The dark frame is subtracted
+  * from each row right after the black level, then the row is divided by
+  * the flat field normalized to the mean of each CFA channel.
+  *
+  * When the input and output names are directories every raw file in
+  * the input tree is converted into the same place in the output tree,
+  * with .tif appended to its name-(IMG_1.CR2 becomes IMG_1.CR2.tif):
+  *
+  * >./raw2tiff /data/raw /data/tiff no 0 0 0 0 -jobs 8 -watch
+  *
+  * An index in the output directory remembers the size and modification
+  * time of each raw file and the options it was converted with, so later
+  * runs only convert new or changed files. The -jobs option sets how many
+  * files are converted at once and -watch keeps running, converting files
+  * as they appear. It uses inotify, so it needs Linux.
   */
 #include <algorithm>
 #include <fstream>
 #include <limits>
 #include <iostream>
+#include <deque>
+#include <map>
+#include <set>
 #include <sstream>
 #include <vector>
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include "libraw/libraw.h"
 #include "tiffio.h"
@@ -76,6 +124,43 @@ const unsigned short ROW_NUMBER_START	= 1;
 const unsigned short NUMBER_OF_COLS	= 2;
 const unsigned short NUMBER_OF_ROWS	= 3;
 
+const std::string STATS_OPTION		= "-stats";
+const std::string STATS_FILE_SUFFIX	= ".json";
+const std::string DARK_OPTION		= "-dark";
+const std::string FLAT_OPTION		= "-flat";
+const std::string WATCH_OPTION		= "-watch";
+const std::string JOBS_OPTION		= "-jobs";
+
+/**
+  * Directory mode settings. The index lives in the output directory.
+  * Changes are appended to the journal as they happen, so a long run
+  * keeps its progress if it is interrupted, and are folded back into
+  * the index at the end of each scan.
+  */
+const std::string TIFF_EXTENSION	= ".tif";
+const std::string INDEX_FILE_NAME	= ".raw2tiff-index";
+const std::string INDEX_HEADER		= "raw2tiff-index 1";
+const std::string JOURNAL_SUFFIX	= ".journal";
+const char JOURNAL_REMOVED		= '-';
+const unsigned int CALIBRATION_PREPARE_ATTEMPTS	= 8;
+const unsigned int KILLED_WORKER_RETRIES	= 1;
+
+const char* const RAW_EXTENSIONS[] = {
+	"3fr", "arw", "cr2", "crw", "dcr", "dng", "erf", "iiq", "k25", "kdc",
+	"mef", "mos", "mrw", "nef", "nrw", "orf", "pef", "raf", "raw", "rw2",
+	"rwl", "sr2", "srf", "srw", "x3f", NULL };
+
+const unsigned short NUMBER_OF_CFA_CHANNELS	= 4;
+const unsigned int HISTOGRAM_BINS		= 65536;
+
+/**
+  * A pixel is counted as hot when it exceeds HOT_PIXEL_RATIO times the
+  * brightest of its same-colour neighbours two pixels away, and does so
+  * by at least 1/HOT_PIXEL_MARGIN_DIVISOR of the saturation level.
+  */
+const unsigned int HOT_PIXEL_RATIO		= 4;
+const unsigned int HOT_PIXEL_MARGIN_DIVISOR	= 32;
+
 /**
   * This class is used to convert a number held in a string
   * into its actual type like an int or a double.
@@ -309,6 +394,64 @@ const std::string method = "writeDataToTiffFile";
 return 0;
 }
 
+/**
+  * This method reads a 16 bit single channel tiff file, such as one
+  * written by this program, into a vector one scanline at a time.
+  */
+int readTiffFile( const std::string& fileName, unsigned int& width, unsigned int& height, std::vector< unsigned short >& data )
+{
+const std::string method = "readTiffFile";
+
+	/**
+	  * Open the file for reading.
+	  */
+	TIFF *in = TIFFOpen( fileName.c_str(), "r" );
+	if( in == NULL )
+	{
+		std::cerr << method << " failed to open the tiff file " << fileName << std::endl;
+		return -1;
+	}
+
+	/**
+	  * Make sure the layout is one we understand.
+	  */
+	uint32 w = 0;
+	uint32 h = 0;
+	uint16 bitsPerSample = 0;
+	uint16 samplesPerPixel = 1;
+	TIFFGetField( in, TIFFTAG_IMAGEWIDTH, &w );
+	TIFFGetField( in, TIFFTAG_IMAGELENGTH, &h );
+	TIFFGetField( in, TIFFTAG_BITSPERSAMPLE, &bitsPerSample );
+	TIFFGetFieldDefaulted( in, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel );
+	if( w == 0 || h == 0 || bitsPerSample != 16 || samplesPerPixel != 1 )
+	{
+		std::cerr << method << " failed. The file " << fileName << " is not a 16 bit single channel tiff image." << std::endl;
+		TIFFClose( in );
+		return -1;
+	}
+
+	/**
+	  * Read the data.
+	  */
+	data.assign( static_cast< size_t >( w ) * h, 0 );
+	for( uint32 row = 0; row < h; row++ )
+	{
+		if( TIFFReadScanline( in, &data[ static_cast< size_t >( row ) * w ], row, 0 ) < 0 )
+		{
+			std::cerr << method << " failed to read row " << row << " of the file " << fileName << std::endl;
+			TIFFClose( in );
+			data.clear();
+			return -1;
+		}
+	}
+
+	TIFFClose( in );
+	width = w;
+	height = h;
+
+return 0;
+}
+
 /**
   * This method does as it name implies, it sets various tiff tags.
   * 
@@ -373,209 +516,569 @@ const std::string method = "setTiffTags";
 return 0;
 }
 
-int main( int argc, char *argv[] )
+/**
+  * This class accumulates per-CFA-channel statistics of the image data
+  * as it is written out, one row at a time. The histograms are kept in
+  * one flat array so that the per pixel work is a single increment.
+  */
+class imageStatistics
 {
-const std::string method = argv[0];
+	private:
 
-	if( argc != 8 )
-	{
-		std::cerr << "usage: raw2tiff input_file_name output_file_name crop_box_yes_or_no col_pos_start-(x) row_pos_start-(y) number_cols number_rows " << std::endl;
-		return 0;
-	}
+		std::vector< unsigned int > histogram;
+		unsigned long long sum[ NUMBER_OF_CFA_CHANNELS ];
+		unsigned long long count[ NUMBER_OF_CFA_CHANNELS ];
+		unsigned long long saturated[ NUMBER_OF_CFA_CHANNELS ];
+		unsigned long long hot[ NUMBER_OF_CFA_CHANNELS ];
+		unsigned short minimum[ NUMBER_OF_CFA_CHANNELS ];
+		unsigned short maximum[ NUMBER_OF_CFA_CHANNELS ];
+		unsigned int saturationLevel;
 
-	/**
-	  * Need a consistent timezone.
-	  */
-	putenv ((char*)"TZ=UTC");
+		/**
+		  * Returns the raw value of the given pixel in its own colour.
+		  */
+		unsigned short rawValue( LibRaw& lr, const unsigned int& row, const unsigned int& col, const int& color ) const
+		{
+			return lr.imgdata.image[ row * lr.imgdata.sizes.width + col ][ color ];
+		}
 
-	/**
-	  * Start parsing the command line arguments.
-	  */
-	std::string inputFileName = argv[1];
-	if( inputFileName.length() < 5 )
-	{
-		std::cerr << method << " failed. The input file name is invalid." << std::endl;
-		return 0;
-	}
+		/**
+		  * Fold the given pixel into neighbourMax if it has the same
+		  * colour. On a Bayer sensor the pixels two rows or columns
+		  * away always do; on other layouts, X-Trans say, some don't.
+		  */
+		void sameColourNeighbour( LibRaw& lr, const unsigned int& row, const unsigned int& col, const int& color, unsigned int& neighbourMax, unsigned int& neighbours ) const
+		{
+			if( lr.fcol( row, col ) != color )
+				return;
 
-	std::string outputFileName = argv[2];
-	if( outputFileName.length() == 0 )
-	{
-		std::cerr << method << " failed. The output file name is invalid." << std::endl;
-		return 0;
-	}
+			neighbourMax = std::max< unsigned int >( neighbourMax, rawValue( lr, row, col, color ) );
+			neighbours++;
+		}
 
-	/**
-	  * Allocate the raw processor.
-	  */
-	LibRaw RawProcessor;
+		/**
+		  * Decide if the pixel is hot by comparing it against the
+		  * nearest pixels of the same colour, two rows/columns away.
+		  * A pixel with no such neighbour is never counted as hot.
+		  */
+		bool isHotPixel( LibRaw& lr, const unsigned int& row, const unsigned int& col, const int& color ) const
+		{
+			const unsigned int value = rawValue( lr, row, col, color );
+			unsigned int neighbourMax = 0;
+			unsigned int neighbours = 0;
+
+			if( col >= 2 )
+				sameColourNeighbour( lr, row, col - 2, color, neighbourMax, neighbours );
+			if( col + 2 < lr.imgdata.sizes.width )
+				sameColourNeighbour( lr, row, col + 2, color, neighbourMax, neighbours );
+			if( row >= 2 )
+				sameColourNeighbour( lr, row - 2, col, color, neighbourMax, neighbours );
+			if( row + 2 < lr.imgdata.sizes.height )
+				sameColourNeighbour( lr, row + 2, col, color, neighbourMax, neighbours );
+
+			return neighbours != 0 && value > HOT_PIXEL_RATIO * neighbourMax && value - neighbourMax > saturationLevel / HOT_PIXEL_MARGIN_DIVISOR;
+		}
 
-	/**
-	  * Initialize the crop box.
-	  */
-	RawProcessor.imgdata.params.cropbox[ COL_NUMBER_START ] = 0;
-	RawProcessor.imgdata.params.cropbox[ ROW_NUMBER_START ] = 0;
-	RawProcessor.imgdata.params.cropbox[ NUMBER_OF_COLS   ] = std::numeric_limits< unsigned long >::max();
-	RawProcessor.imgdata.params.cropbox[ NUMBER_OF_ROWS   ] = std::numeric_limits< unsigned long >::max();
+		/**
+		  * Reset the per channel counters, leaving the histograms be.
+		  */
+		void resetCounters()
+		{
+			for( unsigned short c = 0; c < NUMBER_OF_CFA_CHANNELS; c++ )
+			{
+				sum[ c ] = 0;
+				count[ c ] = 0;
+				saturated[ c ] = 0;
+				hot[ c ] = 0;
+				minimum[ c ] = std::numeric_limits< unsigned short >::max();
+				maximum[ c ] = 0;
+			}
+			return;
+		}
 
-	/**
-	  * If you want a cropbox specify and store its dimensions.
-	  * This is the -B option from dcraw_emu.
-	  */
-	stringConverter sc;
-	std::stringstream ss;
-	std::string wantCropBox = argv[3];
-	int ret = 0;
-	if( wantCropBox.compare( YES ) == 0 )
-	{
+	public:
 
 		/**
-		  * Set the starting column number-(x).
+		  * The histograms are only allocated by initialize(), so an
+		  * unused instance costs nothing.
 		  */
-		const std::string col_pos_start = argv[4];
-		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, col_pos_start, RawProcessor.imgdata.params.cropbox[ COL_NUMBER_START ] );
-		if( ret == -1 )
+		imageStatistics(): saturationLevel( HISTOGRAM_BINS - 1 )
 		{
-			std::cerr << method << " failed on convertTheString for the value " << col_pos_start << std::endl;
-			return -1;
+			this->resetCounters();
 		}
-	
-		const unsigned int colNumberStart = RawProcessor.imgdata.params.cropbox[ COL_NUMBER_START ];
 
 		/**
-		  * Set the the starting row number-(y).
+		  * Allocate the histograms and reset all of the counters. The
+		  * saturation level is the black subtracted white level of the
+		  * sensor.
 		  */
-		const std::string row_pos_start = argv[5];
-		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, row_pos_start, RawProcessor.imgdata.params.cropbox[ ROW_NUMBER_START ] );
-		if( ret == -1 )
+		void initialize( const unsigned int& level )
 		{
-			std::cerr << method << " failed on convertStringToUnsignedInt for the value " << row_pos_start << std::endl;
-			return -1;
+			saturationLevel = level;
+			histogram.assign( NUMBER_OF_CFA_CHANNELS * HISTOGRAM_BINS, 0 );
+			this->resetCounters();
+			return;
 		}
 
-		const unsigned int rowNumberStart = RawProcessor.imgdata.params.cropbox[ ROW_NUMBER_START ];
+		/**
+		  * Add one row of output data to the statistics. The data
+		  * holds the pixels of the given row starting at colStart.
+		  * Saturation and hot pixels are judged on the raw values.
+		  */
+		void accumulateRow( LibRaw& lr, const unsigned int& row, const unsigned int& colStart, const std::vector< unsigned short >& data )
+		{
+			unsigned int* const bins = &histogram[ 0 ];
+
+			for( unsigned int i = 0; i < data.size(); i++ )
+			{
+				const unsigned int col = colStart + i;
+				const int color = lr.fcol( row, col );
+				const unsigned short value = data[ i ];
+
+				bins[ color * HISTOGRAM_BINS + value ]++;
+				sum[ color ] += value;
+				count[ color ]++;
+				minimum[ color ] = std::min( minimum[ color ], value );
+				maximum[ color ] = std::max( maximum[ color ], value );
+
+				if( rawValue( lr, row, col, color ) >= saturationLevel )
+					saturated[ color ]++;
+				else if( isHotPixel( lr, row, col, color ) )
+					hot[ color ]++;
+			}
+			return;
+		}
 
 		/**
-		  * Set the number of columns.
+		  * Write the statistics out as a JSON document. The histogram
+		  * of each channel is trimmed at the channel maximum.
 		  */
-		const std::string numberOfCols = argv[6];
-		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, numberOfCols, RawProcessor.imgdata.params.cropbox[ NUMBER_OF_COLS ] );
-		if( ret == -1 )
+		int writeJsonFile( const std::string& fileName ) const
 		{
-			std::cerr << method << " failed on convertStringToUnsignedInt for the value " << numberOfCols << std::endl;
-			return -1;
+		const std::string method = "writeJsonFile";
+
+			std::ofstream out( fileName.c_str() );
+			if( out.is_open() == false )
+			{
+				std::cerr << method << " failed to open the file " << fileName << std::endl;
+				return -1;
+			}
+
+			out << "{" << std::endl;
+			out << "  \"saturation_level\": " << saturationLevel << "," << std::endl;
+			out << "  \"channels\": [" << std::endl;
+			for( unsigned short c = 0; c < NUMBER_OF_CFA_CHANNELS; c++ )
+			{
+				const double mean = count[ c ] ? static_cast< double >( sum[ c ] ) / count[ c ] : 0.0;
+
+				out << "    {" << std::endl;
+				out << "      \"channel\": " << c << "," << std::endl;
+				out << "      \"count\": " << count[ c ] << "," << std::endl;
+				out << "      \"min\": " << ( count[ c ] ? minimum[ c ] : 0 ) << "," << std::endl;
+				out << "      \"max\": " << maximum[ c ] << "," << std::endl;
+				out << "      \"mean\": " << mean << "," << std::endl;
+				out << "      \"saturated\": " << saturated[ c ] << "," << std::endl;
+				out << "      \"hot\": " << hot[ c ] << "," << std::endl;
+				out << "      \"histogram\": [";
+				for( unsigned int v = 0; count[ c ] && v <= maximum[ c ]; v++ )
+				{
+					out << ( v ? "," : "" ) << histogram[ c * HISTOGRAM_BINS + v ];
+				}
+				out << "]" << std::endl;
+				out << "    }" << ( c + 1 < NUMBER_OF_CFA_CHANNELS ? "," : "" ) << std::endl;
+			}
+			out << "  ]" << std::endl;
+			out << "}" << std::endl;
+
+			if( out.good() == false )
+			{
+				std::cerr << method << " failed to write the file " << fileName << std::endl;
+				return -1;
+			}
+
+		return 0;
 		}
+};
+
+/**
+  * This class holds the master dark frame and flat field and applies
+  * them to the image data one row at a time. The masters are loaded
+  * once; the flat field is turned into a per pixel gain so that the
+  * per row work is two simple loops the compiler can vectorize.
+  */
+class calibrationFrames
+{
+	private:
 
-		const unsigned int imageWidth = RawProcessor.imgdata.params.cropbox[ NUMBER_OF_COLS ];
+		std::vector< unsigned short > dark;
+		std::vector< unsigned short > flat;
+		std::vector< float > gain;
+		unsigned int width;
+		unsigned int height;
 
 		/**
-		  * Set the number of rows.
+		  * Load a master frame and check that it matches any
+		  * master already loaded.
 		  */
-		const std::string numberOfRows = argv[7];
-		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, numberOfRows, RawProcessor.imgdata.params.cropbox[ NUMBER_OF_ROWS ] );
-		if( ret == -1 )
+		int loadFrame( const std::string& fileName, std::vector< unsigned short >& frame )
 		{
-			std::cerr << method << " failed on convertStringToUnsignedInt for the value " << numberOfRows << std::endl;
-			return -1;
-		}
+		const std::string method = "loadFrame";
+
+			unsigned int w = 0;
+			unsigned int h = 0;
+			if( -1 == readTiffFile( fileName, w, h, frame ) )
+			{
+				std::cerr << method << " failed to load the master frame " << fileName << std::endl;
+				return -1;
+			}
 
-		const unsigned int imageHeight = RawProcessor.imgdata.params.cropbox[ NUMBER_OF_ROWS ];
+			if( width != 0 && ( w != width || h != height ) )
+			{
+				std::cerr << method << " failed. The master frames " << fileName << " have different dimensions." << std::endl;
+				frame.clear();
+				return -1;
+			}
 
-		std::cerr << "Crop Box[COL_NUMBER_START]->" << RawProcessor.imgdata.params.cropbox[ 0 ] << std::endl;
-		std::cerr << "Crop Box[ROW_NUMBER_START]->" << RawProcessor.imgdata.params.cropbox[ 1 ] << std::endl;
-		std::cerr << "Crop Box[NUMBER_OF_COLS]->" << RawProcessor.imgdata.params.cropbox[ 2 ] << std::endl;
-		std::cerr << "Crop Box[NUMBER_OF_ROWS]->" << RawProcessor.imgdata.params.cropbox[ 3 ] << std::endl;
+			width = w;
+			height = h;
 
-	}
+		return 0;
+		}
 
-	/**
-	  * Attempt to open the specified the file.
-	  */
-	ret = RawProcessor.open_file( inputFileName.c_str() );
-	if( ret != LIBRAW_SUCCESS )
-	{
-		std::cerr << method << " failed on open_file for the file " << inputFileName << std::endl;
-		std::cerr << " The error is " << libraw_strerror(ret) << std::endl;
-		RawProcessor.recycle();
-		return 1;
-	}
+	public:
 
-	/**
-	  * Set the dimensions of the image.
-	  */
-	unsigned int colNumberStart = 0;
-	unsigned int rowNumberStart = 0;
-	unsigned int imageHeight = RawProcessor.imgdata.sizes.height;
-	unsigned int imageWidth = RawProcessor.imgdata.sizes.width;
+		calibrationFrames(): width( 0 ), height( 0 ){}
 
-	/**
-	  * Verify the dimensions of the crop box.
-	  */
-	if( wantCropBox.compare( YES ) == 0 )
-	{
-		ret = verifyCropBoxValues( RawProcessor );
-		if( ret == -1 )
+		/**
+		  * True when there is nothing to apply. Once prepared the
+		  * flat field only survives as its gains, so check those too.
+		  */
+		bool empty() const
 		{
-			std::cerr << method << " cannot proceed. The crop box values are not acceptable." << std::endl;
-			RawProcessor.recycle();
-			return ret;
+			return dark.empty() && flat.empty() && gain.empty();
 		}
 
 		/**
-		  * Set the image dimensions to the crop box specification.
+		  * True until the flat field gains have been built.
 		  */
-		colNumberStart = RawProcessor.imgdata.params.cropbox[ COL_NUMBER_START ];
-		rowNumberStart = RawProcessor.imgdata.params.cropbox[ ROW_NUMBER_START ];
-		imageWidth = colNumberStart + RawProcessor.imgdata.params.cropbox[ NUMBER_OF_COLS ];
-		imageHeight = rowNumberStart + RawProcessor.imgdata.params.cropbox[ NUMBER_OF_ROWS ];
-	}
+		bool needsPreparing() const
+		{
+			return flat.empty() == false && gain.empty() == true;
+		}
 
-	/**
-	  * Get the image information.
-	  */
-	getImageInformation( RawProcessor );
+		int loadDarkFrame( const std::string& fileName )
+		{
+			return loadFrame( fileName, dark );
+		}
 
-	/**
-	  * Try to unpack the data.
-	  */
-	ret = RawProcessor.unpack();
-	if( ret != LIBRAW_SUCCESS )
-	{
-		std::cerr << method << " failed on unpack for the file " << inputFileName << std::endl;
-		std::cerr << " The error is " << libraw_strerror(ret) << std::endl;
-		RawProcessor.recycle();
-		return 1;
-	}
+		int loadFlatField( const std::string& fileName )
+		{
+			return loadFrame( fileName, flat );
+		}
 
-	/**
-	  * Call raw2image.
-	  */
-	ret = RawProcessor.raw2image();
-	if( ret != LIBRAW_SUCCESS )
-	{
-		std::cerr << method << " failed on raw2image for the file " << inputFileName << std::endl;
-		std::cerr << " The error is " << libraw_strerror(ret) << std::endl;
-		RawProcessor.recycle();
-		return 1;
-	}
+		/**
+		  * Check the masters against the image and, the first time
+		  * through, build the flat field gains. The flat field is
+		  * normalized per CFA channel so it does not shift the colour
+		  * balance. Pixels with no flat signal are left as they are.
+		  */
+		int prepare( LibRaw& lr )
+		{
+		const std::string method = "prepare";
 
-	/**
-	  * Call subtract_black.
-	  */
-	RawProcessor.subtract_black();
+			if( empty() == true )
+				return 0;
 
-	/**
-	  * Open the tiff file.
-	  */
-	TIFF *out = NULL;
-	if( -1 == openTiffFile( outputFileName, out ) )
-	{
-		std::cerr << method << " failed to create the tiff file " << outputFileName << std::endl;
-		return -1;
-	}
+			if( width != lr.imgdata.sizes.width || height != lr.imgdata.sizes.height )
+			{
+				std::cerr << method << " failed. The master frames are " << width << "x" << height << " but the image is " << lr.imgdata.sizes.width << "x" << lr.imgdata.sizes.height << std::endl;
+				return -1;
+			}
 
-	/**
-	  * Set the image description.
+			if( flat.empty() == true || gain.empty() == false )
+				return 0;
+
+			double sum[ NUMBER_OF_CFA_CHANNELS ] = { 0.0 };
+			unsigned long long count[ NUMBER_OF_CFA_CHANNELS ] = { 0 };
+			for( unsigned int row = 0; row < height; row++ )
+			{
+				for( unsigned int col = 0; col < width; col++ )
+				{
+					const int color = lr.fcol( row, col );
+					sum[ color ] += flat[ row * width + col ];
+					count[ color ]++;
+				}
+			}
+
+			gain.assign( flat.size(), 1.0f );
+			for( unsigned int row = 0; row < height; row++ )
+			{
+				for( unsigned int col = 0; col < width; col++ )
+				{
+					const int color = lr.fcol( row, col );
+					const unsigned short value = flat[ row * width + col ];
+					if( value != 0 && count[ color ] != 0 )
+						gain[ row * width + col ] = static_cast< float >( sum[ color ] / count[ color ] / value );
+				}
+			}
+
+			/**
+			  * Only the gains are needed from here on.
+			  */
+			std::vector< unsigned short >().swap( flat );
+
+		return 0;
+		}
+
+		/**
+		  * Apply the masters to one row of data starting at colStart.
+		  */
+		void calibrateRow( const unsigned int& row, const unsigned int& colStart, std::vector< unsigned short >& data ) const
+		{
+			const size_t offset = static_cast< size_t >( row ) * width + colStart;
+			const size_t n = data.size();
+			unsigned short* const d = &data[ 0 ];
+
+			if( dark.empty() == false )
+			{
+				const unsigned short* const dk = &dark[ offset ];
+				for( size_t i = 0; i < n; i++ )
+				{
+					d[ i ] = d[ i ] > dk[ i ] ? d[ i ] - dk[ i ] : 0;
+				}
+			}
+
+			if( gain.empty() == false )
+			{
+				const float* const g = &gain[ offset ];
+				for( size_t i = 0; i < n; i++ )
+				{
+					const float value = d[ i ] * g[ i ] + 0.5f;
+					d[ i ] = value < 65535.0f ? static_cast< unsigned short >( value ) : 65535;
+				}
+			}
+			return;
+		}
+};
+
+/**
+  * The settings that control how each raw file is converted. The
+  * signature describes them as text so that a change of settings
+  * can be detected in directory mode.
+  */
+class conversionOptions
+{
+	public:
+
+		bool wantCropBox;
+		bool wantStats;
+		unsigned int cropbox[ 4 ];
+		calibrationFrames calibration;
+		std::string signature;
+
+		conversionOptions(): wantCropBox( false ), wantStats( false )
+		{
+			cropbox[ COL_NUMBER_START ] = 0;
+			cropbox[ ROW_NUMBER_START ] = 0;
+			cropbox[ NUMBER_OF_COLS   ] = std::numeric_limits< unsigned int >::max();
+			cropbox[ NUMBER_OF_ROWS   ] = std::numeric_limits< unsigned int >::max();
+		}
+};
+
+/**
+  * Returns true if the path names a directory.
+  */
+bool isDirectory( const std::string& path )
+{
+	struct stat st;
+	return stat( path.c_str(), &st ) == 0 && S_ISDIR( st.st_mode );
+}
+
+/**
+  * Describe a file by its name, size and modification time so that
+  * replacing a master calibration frame changes the options signature.
+  */
+std::string fileSignature( const std::string& path )
+{
+	std::stringstream ss;
+	struct stat st;
+	ss << path;
+	if( stat( path.c_str(), &st ) == 0 )
+	{
+		ss << ":" << st.st_size << ":" << st.st_mtime;
+	}
+	return ss.str();
+}
+
+/**
+  * 64 bit FNV-1a hash of a string.
+  */
+unsigned long long hashString( const std::string& value )
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for( size_t i = 0; i < value.length(); i++ )
+	{
+		hash ^= static_cast< unsigned char >( value[ i ] );
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+  * Build the flat field gains from the CFA pattern of the given raw
+  * file. Directory mode does this once before starting its workers
+  * so that they all inherit the same gain table.
+  */
+int prepareCalibration( const std::string& inputFileName, conversionOptions& options )
+{
+const std::string method = "prepareCalibration";
+
+	LibRaw RawProcessor;
+	int ret = RawProcessor.open_file( inputFileName.c_str() );
+	if( ret != LIBRAW_SUCCESS )
+	{
+		std::cerr << method << " failed on open_file for the file " << inputFileName << std::endl;
+		std::cerr << " The error is " << libraw_strerror(ret) << std::endl;
+		RawProcessor.recycle();
+		return -1;
+	}
+
+	ret = options.calibration.prepare( RawProcessor );
+	RawProcessor.recycle();
+
+return ret;
+}
+
+/**
+  * This method converts a single raw file into a tiff file using
+  * the crop box, statistics and calibration settings in options.
+  */
+int convertRawFile( const std::string& inputFileName, const std::string& outputFileName, conversionOptions& options )
+{
+const std::string method = "convertRawFile";
+
+	/**
+	  * Allocate the raw processor.
+	  */
+	LibRaw RawProcessor;
+
+	/**
+	  * Set the crop box.
+	  */
+	for( unsigned short i = 0; i < 4; i++ )
+	{
+		RawProcessor.imgdata.params.cropbox[ i ] = options.cropbox[ i ];
+	}
+	int ret = 0;
+
+	/**
+	  * Attempt to open the specified the file.
+	  */
+	ret = RawProcessor.open_file( inputFileName.c_str() );
+	if( ret != LIBRAW_SUCCESS )
+	{
+		std::cerr << method << " failed on open_file for the file " << inputFileName << std::endl;
+		std::cerr << " The error is " << libraw_strerror(ret) << std::endl;
+		RawProcessor.recycle();
+		return 1;
+	}
+
+	/**
+	  * Set the dimensions of the image.
+	  */
+	unsigned int colNumberStart = 0;
+	unsigned int rowNumberStart = 0;
+	unsigned int imageHeight = RawProcessor.imgdata.sizes.height;
+	unsigned int imageWidth = RawProcessor.imgdata.sizes.width;
+
+	/**
+	  * Verify the dimensions of the crop box.
+	  */
+	if( options.wantCropBox == true )
+	{
+		ret = verifyCropBoxValues( RawProcessor );
+		if( ret == -1 )
+		{
+			std::cerr << method << " cannot proceed. The crop box values are not acceptable." << std::endl;
+			RawProcessor.recycle();
+			return ret;
+		}
+
+		/**
+		  * Set the image dimensions to the crop box specification.
+		  */
+		colNumberStart = RawProcessor.imgdata.params.cropbox[ COL_NUMBER_START ];
+		rowNumberStart = RawProcessor.imgdata.params.cropbox[ ROW_NUMBER_START ];
+		imageWidth = colNumberStart + RawProcessor.imgdata.params.cropbox[ NUMBER_OF_COLS ];
+		imageHeight = rowNumberStart + RawProcessor.imgdata.params.cropbox[ NUMBER_OF_ROWS ];
+	}
+
+	/**
+	  * Get the image information.
+	  */
+	getImageInformation( RawProcessor );
+
+	/**
+	  * Try to unpack the data.
+	  */
+	ret = RawProcessor.unpack();
+	if( ret != LIBRAW_SUCCESS )
+	{
+		std::cerr << method << " failed on unpack for the file " << inputFileName << std::endl;
+		std::cerr << " The error is " << libraw_strerror(ret) << std::endl;
+		RawProcessor.recycle();
+		return 1;
+	}
+
+	/**
+	  * Call raw2image.
+	  */
+	ret = RawProcessor.raw2image();
+	if( ret != LIBRAW_SUCCESS )
+	{
+		std::cerr << method << " failed on raw2image for the file " << inputFileName << std::endl;
+		std::cerr << " The error is " << libraw_strerror(ret) << std::endl;
+		RawProcessor.recycle();
+		return 1;
+	}
+
+	/**
+	  * Call subtract_black.
+	  */
+	RawProcessor.subtract_black();
+
+	/**
+	  * Get the calibration frames ready for this image.
+	  */
+	if( -1 == options.calibration.prepare( RawProcessor ) )
+	{
+		std::cerr << method << " cannot apply the calibration frames to the file " << inputFileName << std::endl;
+		RawProcessor.recycle();
+		return -1;
+	}
+
+	/**
+	  * Prepare the statistics, the saturation level is only
+	  * known once the black level has been subtracted.
+	  */
+	imageStatistics stats;
+	if( options.wantStats == true )
+	{
+		stats.initialize( RawProcessor.imgdata.color.maximum );
+	}
+
+	/**
+	  * Open the tiff file.
+	  */
+	TIFF *out = NULL;
+	if( -1 == openTiffFile( outputFileName, out ) )
+	{
+		std::cerr << method << " failed to create the tiff file " << outputFileName << std::endl;
+		return -1;
+	}
+
+	/**
+	  * Set the image description.
 	  */
 	std::stringstream imageDescription;
 	imageDescription.clear();
@@ -620,7 +1123,7 @@ const std::string method = argv[0];
 	/**
 	  * Set the tiff tags.
 	  */
-	if( wantCropBox.compare( YES ) == 0 )
+	if( options.wantCropBox == true )
 	{
 		if( -1 == setTiffTags( out, RawProcessor.imgdata.params.cropbox[ NUMBER_OF_COLS ], RawProcessor.imgdata.params.cropbox[ NUMBER_OF_ROWS ], imageDescription.str(), &dateTimeBuffer[0] ) )
 		{
@@ -641,9 +1144,10 @@ const std::string method = argv[0];
 	  * Using a vector to hold the image data.
 	  * Place the image buffer into the vector dataVector.
 	  */
+	const unsigned int rowLength = imageWidth - colNumberStart;
 	std::vector< unsigned short > dataVector;
-	dataVector.reserve( imageWidth );//must be here.
-	dataVector.assign( imageWidth, 0 );//must be here.
+	dataVector.reserve( rowLength );//must be here.
+	dataVector.assign( rowLength, 0 );//must be here.
 
 	/**
 	  * Show the image dimensions to be used.
@@ -673,24 +1177,40 @@ const std::string method = argv[0];
 		colPos = 0;
 		for( unsigned int col = colNumberStart; col < imageWidth; col++ )
 		{
-			dataVector.at( colPos ) = RawProcessor.imgdata.image[ row * imageWidth + col ][ RawProcessor.fcol( row, col ) ];
+			dataVector.at( colPos ) = RawProcessor.imgdata.image[ row * RawProcessor.imgdata.sizes.width + col ][ RawProcessor.fcol( row, col ) ];
 			colPos++;
 		}
 
+		/**
+		  * Apply the dark frame and flat field.
+		  */
+		if( options.calibration.empty() == false )
+		{
+			options.calibration.calibrateRow( row, colNumberStart, dataVector );
+		}
+
+		/**
+		  * Gather the statistics while the row is still in cache.
+		  */
+		if( options.wantStats == true )
+		{
+			stats.accumulateRow( RawProcessor, row, colNumberStart, dataVector );
+		}
+
 		/**
 		  * Write the datavector to the target tiff file.
 		  */
 		rv = writeDataToTiffFile( out, rowPos, dataVector );
 		if( rv == -1 )
 		{
-			std::cerr << argv[0] << " failed on writeDataToTiffFile. " << std::endl;
+			std::cerr << method << " failed on writeDataToTiffFile. " << std::endl;
 			break;
 		}
 
 		/**
 		  * re-initialize the datavector.
 		  */
-		dataVector.assign( imageWidth, 0 );
+		dataVector.assign( rowLength, 0 );
 
 		/**
 		  * Next row.
@@ -708,10 +1228,1081 @@ const std::string method = argv[0];
 	  */
 	TIFFClose(out);
 
+	/**
+	  * Write out the statistics sidecar file.
+	  */
+	if( options.wantStats == true && rv == 0 )
+	{
+		if( -1 == stats.writeJsonFile( outputFileName + STATS_FILE_SUFFIX ) )
+		{
+			std::cerr << method << " failed to write the statistics for the file " << outputFileName << std::endl;
+			RawProcessor.recycle();
+			return -1;
+		}
+	}
+
 	/**
 	  * It is over, be happy.
 	  */
 	RawProcessor.recycle();
 
-return 0;
+return rv;
+}
+
+/**
+  * One line of the directory index. A raw file is up to date when its
+  * size, modification time and the options hash all match its entry.
+  * Files that failed to convert are kept with an empty output so they
+  * are not retried until they change. Files whose worker was killed,
+  * by the OOM killer say, are left out so the next run tries again.
+  */
+class indexEntry
+{
+	public:
+
+		unsigned long long size;
+		long long mtimeSec;
+		long mtimeNsec;
+		unsigned long long optionsHash;
+		std::string output;
+		bool seen;
+
+		indexEntry(): size( 0 ), mtimeSec( 0 ), mtimeNsec( 0 ), optionsHash( 0 ), seen( false ){}
+};
+
+/**
+  * This class converts every raw file in a directory tree into a
+  * mirrored tree of tiff files. A persistent index in the output
+  * directory records what has been converted, so a rescan only has
+  * to stat the raw files and convert the ones that are new or have
+  * changed. In watch mode inotify keeps the tree up to date after the
+  * first scan.
+  *
+  * Each conversion runs in a forked worker, up to jobs at a time. The
+  * workers share the loaded calibration frames with the parent, and a
+  * file that crashes LibRaw only takes its own worker down.
+  */
+class directoryConverter
+{
+	private:
+
+		typedef std::map< std::string, indexEntry > indexMap;
+
+		std::string inputDirectory;
+		std::string outputDirectory;
+		std::string indexFileName;
+		std::string journalFileName;
+		std::ofstream journal;
+		unsigned long long journalLines;
+		conversionOptions& options;
+		unsigned long long optionsHash;
+		unsigned int jobs;
+		indexMap index;
+		std::deque< std::pair< std::string, indexEntry > > pending;
+		std::map< pid_t, std::pair< std::string, indexEntry > > running;
+		std::set< std::string > queued;
+		std::set< std::string > prepareTried;
+		unsigned long long failures;
+		bool retryKilled;
+		std::map< std::string, unsigned int > killCount;
+		int inotifyFd;
+		std::map< int, std::string > watches;
+
+		/**
+		  * Returns true if the file name has a raw file extension.
+		  */
+		static bool isRawFileName( const char* name )
+		{
+			const char* dot = strrchr( name, '.' );
+			if( dot == NULL )
+				return false;
+
+			for( unsigned int i = 0; RAW_EXTENSIONS[ i ] != NULL; i++ )
+			{
+				if( strcasecmp( dot + 1, RAW_EXTENSIONS[ i ] ) == 0 )
+					return true;
+			}
+			return false;
+		}
+
+		/**
+		  * The tiff file for a raw file mirrors its relative path.
+		  * The raw extension is kept so that a raw file and a dng of
+		  * the same name-(IMG_1.CR2, IMG_1.DNG)-do not collide.
+		  */
+		std::string outputPathFor( const std::string& relativePath ) const
+		{
+			return outputDirectory + FWD_SLASH + relativePath + TIFF_EXTENSION;
+		}
+
+		/**
+		  * Create the directories leading up to the given file.
+		  */
+		int makeParentDirectories( const std::string& path ) const
+		{
+		const std::string method = "makeParentDirectories";
+
+			for( size_t pos = path.find( FWD_SLASH, 1 ); pos != std::string::npos; pos = path.find( FWD_SLASH, pos + 1 ) )
+			{
+				const std::string directory = path.substr( 0, pos );
+				if( mkdir( directory.c_str(), 0777 ) != 0 && errno != EEXIST )
+				{
+					std::cerr << method << " failed to create the directory " << directory << ": " << strerror( errno ) << std::endl;
+					return -1;
+				}
+			}
+			return 0;
+		}
+
+		/**
+		  * Copy the size and modification time into an index entry.
+		  */
+		static void describeFile( indexEntry& entry, const struct stat& st )
+		{
+			entry.size = st.st_size;
+			entry.mtimeSec = st.st_mtime;
+			entry.mtimeNsec = modificationTimeNsec( st );
+		}
+
+		/**
+		  * Queue the file for conversion unless the index says it
+		  * is up to date or it is already queued.
+		  */
+		void checkFile( const std::string& relativePath, const struct stat& st )
+		{
+			indexEntry entry;
+			describeFile( entry, st );
+			entry.optionsHash = optionsHash;
+			entry.seen = true;
+
+			indexMap::iterator it = index.find( relativePath );
+			if( it != index.end() )
+			{
+				it->second.seen = true;
+				if( it->second.size == entry.size && it->second.mtimeSec == entry.mtimeSec && it->second.mtimeNsec == entry.mtimeNsec && it->second.optionsHash == entry.optionsHash )
+					return;
+			}
+
+			if( queued.insert( relativePath ).second == false )
+				return;
+
+			pending.push_back( std::make_pair( relativePath, entry ) );
+		}
+
+		/**
+		  * The sub-second part of the modification time, where the
+		  * platform has one.
+		  */
+		static long modificationTimeNsec( const struct stat& st )
+		{
+#if defined( __linux__ )
+			return st.st_mtim.tv_nsec;
+#elif defined( __APPLE__ )
+			return st.st_mtimespec.tv_nsec;
+#else
+			return 0;
+#endif
+		}
+
+#ifdef __linux__
+		/**
+		  * Start watching a directory for new and changed files.
+		  */
+		void addWatch( const std::string& relativeDirectory )
+		{
+		const std::string method = "addWatch";
+
+			const std::string path = relativeDirectory.empty() ? inputDirectory : inputDirectory + FWD_SLASH + relativeDirectory;
+			const int wd = inotify_add_watch( inotifyFd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR );
+			if( wd < 0 )
+			{
+				std::cerr << method << " failed to watch the directory " << path << ": " << strerror( errno ) << std::endl;
+				return;
+			}
+			watches[ wd ] = relativeDirectory;
+		}
+#endif
+
+		/**
+		  * Walk a directory, relative to the input directory, checking
+		  * every raw file below it. Only raw files are stat'ed and the
+		  * stat is relative to the open directory to keep rescans cheap.
+		  */
+		void scanTree( const std::string& relativeDirectory )
+		{
+		const std::string method = "scanTree";
+
+			const std::string path = relativeDirectory.empty() ? inputDirectory : inputDirectory + FWD_SLASH + relativeDirectory;
+			DIR* dir = opendir( path.c_str() );
+			if( dir == NULL )
+			{
+				std::cerr << method << " failed to open the directory " << path << ": " << strerror( errno ) << std::endl;
+				return;
+			}
+
+#ifdef __linux__
+			if( inotifyFd >= 0 )
+			{
+				addWatch( relativeDirectory );
+			}
+#endif
+
+			std::vector< std::string > subDirectories;
+			struct dirent* de;
+			while( ( de = readdir( dir ) ) != NULL )
+			{
+				if( de->d_name[ 0 ] == '.' )
+					continue;
+
+				const std::string relativePath = relativeDirectory.empty() ? std::string( de->d_name ) : relativeDirectory + FWD_SLASH + de->d_name;
+				const bool rawName = isRawFileName( de->d_name );
+#ifdef DT_UNKNOWN
+				if( de->d_type == DT_DIR )
+				{
+					subDirectories.push_back( relativePath );
+					continue;
+				}
+				if( de->d_type != DT_UNKNOWN && de->d_type != DT_REG )
+					continue;
+				if( de->d_type == DT_REG && rawName == false )
+					continue;
+#endif
+
+				struct stat st;
+				if( fstatat( dirfd( dir ), de->d_name, &st, AT_SYMLINK_NOFOLLOW ) != 0 )
+					continue;
+
+				if( S_ISDIR( st.st_mode ) )
+					subDirectories.push_back( relativePath );
+				else if( S_ISREG( st.st_mode ) && rawName == true )
+					checkFile( relativePath, st );
+			}
+			closedir( dir );
+
+			for( size_t i = 0; i < subDirectories.size(); i++ )
+			{
+				scanTree( subDirectories[ i ] );
+			}
+		}
+
+		/**
+		  * Build the flat field gains here rather than in every
+		  * worker. The first file that opens provides the CFA
+		  * pattern; the masters belong to one camera anyway.
+		  * Each file is tried only once, and only the first few
+		  * files overall; if none fit, the workers report it.
+		  */
+		void prepareGains()
+		{
+			for( size_t i = 0; i < pending.size() && prepareTried.size() < CALIBRATION_PREPARE_ATTEMPTS && options.calibration.needsPreparing() == true; i++ )
+			{
+				if( prepareTried.insert( pending[ i ].first ).second == false )
+					continue;
+
+				if( 0 == prepareCalibration( inputDirectory + FWD_SLASH + pending[ i ].first, options ) )
+					break;
+			}
+		}
+
+		/**
+		  * Start workers on queued files until jobs are running. The
+		  * size and time of each file are taken just before its worker
+		  * starts, so that only a change made during the conversion
+		  * queues it again.
+		  */
+		int startWorkers()
+		{
+		const std::string method = "startWorkers";
+
+			prepareGains();
+
+			while( pending.empty() == false && running.size() < jobs )
+			{
+				std::pair< std::string, indexEntry > job = pending.front();
+				pending.pop_front();
+
+				const std::string inputPath = inputDirectory + FWD_SLASH + job.first;
+				const std::string outputPath = outputPathFor( job.first );
+
+				struct stat st;
+				if( lstat( inputPath.c_str(), &st ) != 0 || S_ISREG( st.st_mode ) == false )
+				{
+					queued.erase( job.first );
+					continue;
+				}
+				describeFile( job.second, st );
+
+				if( -1 == makeParentDirectories( outputPath ) )
+				{
+					queued.erase( job.first );
+					failures++;
+					continue;
+				}
+
+				std::cerr.flush();
+				std::cout.flush();
+				const pid_t pid = fork();
+				if( pid < 0 )
+				{
+					std::cerr << method << " failed to fork: " << strerror( errno ) << std::endl;
+					pending.push_front( job );
+					return -1;
+				}
+				if( pid == 0 )
+				{
+					_exit( convertRawFile( inputPath, outputPath, options ) == 0 ? 0 : 1 );
+				}
+
+				job.second.output = outputPath;
+				running[ pid ] = job;
+			}
+
+		return 0;
+		}
+
+		/**
+		  * Collect a finished worker and record the result in the
+		  * index. Unless block is set this does not wait. Returns 1
+		  * if a worker was collected, 0 if none was, -1 on error.
+		  */
+		int reapWorker( const bool& block )
+		{
+		const std::string method = "reapWorker";
+
+			if( running.empty() == true )
+				return 0;
+
+			int status = 0;
+			const pid_t pid = waitpid( -1, &status, block == true ? 0 : WNOHANG );
+			if( pid == 0 || ( pid < 0 && errno == EINTR ) )
+				return 0;
+			if( pid < 0 )
+			{
+				std::cerr << method << " failed on waitpid: " << strerror( errno ) << std::endl;
+				return -1;
+			}
+
+			std::map< pid_t, std::pair< std::string, indexEntry > >::iterator it = running.find( pid );
+			if( it == running.end() )
+				return 1;
+
+			std::pair< std::string, indexEntry > job = it->second;
+			running.erase( it );
+			queued.erase( job.first );
+
+			/**
+			  * A killed worker is most likely a passing problem, such
+			  * as running out of memory. When watching, a later run may
+			  * be a long way off, so the file is queued again right
+			  * away, but only a few times in case it is the file itself
+			  * that kills the worker.
+			  */
+			if( WIFEXITED( status ) == false )
+			{
+				if( retryKilled == true && ++killCount[ job.first ] <= KILLED_WORKER_RETRIES )
+				{
+					std::cerr << method << " the worker converting " << job.first << " was killed, trying again." << std::endl;
+					queued.insert( job.first );
+					pending.push_back( job );
+					return 1;
+				}
+
+				std::cerr << method << " the worker converting " << job.first << " was killed, it will be retried on the next run." << std::endl;
+				killCount.erase( job.first );
+				failures++;
+				return 1;
+			}
+			killCount.erase( job.first );
+
+			if( WEXITSTATUS( status ) != 0 )
+			{
+				std::cerr << method << " failed to convert the file " << job.first << std::endl;
+				job.second.output.clear();
+				failures++;
+			}
+
+			index[ job.first ] = job.second;
+			journalEntry( job.first, job.second );
+
+			/**
+			  * If the file changed while it was being converted
+			  * this queues it again.
+			  */
+			struct stat st;
+			const std::string inputPath = inputDirectory + FWD_SLASH + job.first;
+			if( lstat( inputPath.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) )
+				checkFile( job.first, st );
+
+		return 1;
+		}
+
+		/**
+		  * Convert everything that is queued, up to jobs at a time.
+		  */
+		int runPending()
+		{
+			while( pending.empty() == false || running.empty() == false )
+			{
+				if( -1 == startWorkers() && running.empty() == true )
+				{
+					failures += pending.size();
+					pending.clear();
+					queued.clear();
+					return -1;
+				}
+
+				if( -1 == reapWorker( true ) )
+					return -1;
+			}
+
+		return 0;
+		}
+
+		/**
+		  * Walk the whole input tree, queueing whatever is out of date,
+		  * and drop index entries for raw files that have gone away.
+		  */
+		void rescan()
+		{
+			for( indexMap::iterator it = index.begin(); it != index.end(); ++it )
+			{
+				it->second.seen = false;
+			}
+
+			scanTree( "" );
+
+			for( indexMap::iterator it = index.begin(); it != index.end(); )
+			{
+				if( it->second.seen == false )
+				{
+					journalRemoval( it->first );
+					index.erase( it++ );
+				}
+				else
+					++it;
+			}
+		}
+
+		/**
+		  * Write one index line. The path goes last as it is the
+		  * field most likely to hold spaces.
+		  */
+		static void writeEntry( std::ostream& out, const std::string& relativePath, const indexEntry& e )
+		{
+			out << e.size << ' ' << e.mtimeSec << ' ' << e.mtimeNsec << ' ' << std::hex << e.optionsHash << std::dec << '\t' << e.output << '\t' << relativePath << '\n';
+		}
+
+		/**
+		  * Apply index lines to the index. A journal line that starts
+		  * with JOURNAL_REMOVED drops the entry for its path. Lines
+		  * that do not parse, like one cut short by a crash, are
+		  * skipped. Returns the number of lines read.
+		  */
+		unsigned long long readEntries( std::istream& in )
+		{
+			unsigned long long lines = 0;
+			std::string line;
+			while( std::getline( in, line ) )
+			{
+				lines++;
+				const size_t tab1 = line.find( '\t' );
+				const size_t tab2 = tab1 == std::string::npos ? tab1 : line.find( '\t', tab1 + 1 );
+				if( tab2 == std::string::npos )
+					continue;
+
+				if( line[ 0 ] == JOURNAL_REMOVED )
+				{
+					index.erase( line.substr( tab2 + 1 ) );
+					continue;
+				}
+
+				indexEntry entry;
+				std::istringstream fields( line.substr( 0, tab1 ) );
+				fields >> entry.size >> entry.mtimeSec >> entry.mtimeNsec >> std::hex >> entry.optionsHash;
+				if( fields.fail() == true )
+					continue;
+
+				entry.output = line.substr( tab1 + 1, tab2 - tab1 - 1 );
+				index[ line.substr( tab2 + 1 ) ] = entry;
+			}
+			return lines;
+		}
+
+		/**
+		  * Read the index and journal written by a previous run. A
+		  * missing index just means everything gets converted. A
+		  * leftover journal is folded in straight away so that new
+		  * lines are never appended after a half written one.
+		  */
+		void loadIndex()
+		{
+			std::ifstream in( indexFileName.c_str() );
+			if( in.is_open() == true )
+			{
+				std::string line;
+				if( !std::getline( in, line ) || line.compare( INDEX_HEADER ) != 0 )
+					std::cerr << "loadIndex ignoring the unrecognized index " << indexFileName << std::endl;
+				else
+					readEntries( in );
+			}
+
+			std::ifstream pendingJournal( journalFileName.c_str() );
+			if( pendingJournal.is_open() == true && readEntries( pendingJournal ) != 0 )
+			{
+				saveIndex();
+			}
+		}
+
+		/**
+		  * Append a change to the journal. Each line is flushed so
+		  * that it survives the process being killed.
+		  */
+		void journalEntry( const std::string& relativePath, const indexEntry& entry )
+		{
+			if( journal.is_open() == false )
+				journal.open( journalFileName.c_str(), std::ios::out | std::ios::app );
+
+			writeEntry( journal, relativePath, entry );
+			journal.flush();
+			journalLines++;
+		}
+
+		void journalRemoval( const std::string& relativePath )
+		{
+			if( journal.is_open() == false )
+				journal.open( journalFileName.c_str(), std::ios::out | std::ios::app );
+
+			journal << JOURNAL_REMOVED << "\t\t" << relativePath << '\n';
+			journal.flush();
+			journalLines++;
+		}
+
+		/**
+		  * Write the whole index out and empty the journal. The index
+		  * goes to a temporary file first so an interrupted run never
+		  * leaves a truncated index behind; if we stop before the
+		  * journal is emptied, replaying it again does no harm.
+		  */
+		int saveIndex()
+		{
+		const std::string method = "saveIndex";
+
+			const std::string temporaryName = indexFileName + ".tmp";
+			std::ofstream out( temporaryName.c_str() );
+			if( out.is_open() == false )
+			{
+				std::cerr << method << " failed to open the file " << temporaryName << std::endl;
+				return -1;
+			}
+
+			out << INDEX_HEADER << '\n';
+			for( indexMap::const_iterator it = index.begin(); it != index.end(); ++it )
+			{
+				writeEntry( out, it->first, it->second );
+			}
+			out.close();
+
+			if( out.fail() == true || rename( temporaryName.c_str(), indexFileName.c_str() ) != 0 )
+			{
+				std::cerr << method << " failed to write the index " << indexFileName << std::endl;
+				return -1;
+			}
+
+			if( journal.is_open() == true )
+				journal.close();
+			journal.clear();
+			journal.open( journalFileName.c_str(), std::ios::out | std::ios::trunc );
+			journalLines = 0;
+
+		return 0;
+		}
+
+	public:
+
+		directoryConverter( const std::string& input, const std::string& output, conversionOptions& opts, const unsigned int& numberOfJobs ):
+			inputDirectory( input ),
+			outputDirectory( output ),
+			journalLines( 0 ),
+			options( opts ),
+			optionsHash( hashString( opts.signature ) ),
+			jobs( numberOfJobs ),
+			failures( 0 ),
+			retryKilled( false ),
+			inotifyFd( -1 )
+		{
+			while( inputDirectory.length() > 1 && inputDirectory[ inputDirectory.length() - 1 ] == FWD_SLASH )
+				inputDirectory.erase( inputDirectory.length() - 1 );
+			while( outputDirectory.length() > 1 && outputDirectory[ outputDirectory.length() - 1 ] == FWD_SLASH )
+				outputDirectory.erase( outputDirectory.length() - 1 );
+			indexFileName = outputDirectory + FWD_SLASH + INDEX_FILE_NAME;
+			journalFileName = indexFileName + JOURNAL_SUFFIX;
+		}
+
+		~directoryConverter()
+		{
+			if( inotifyFd >= 0 )
+				close( inotifyFd );
+		}
+
+		/**
+		  * Scan the whole input tree and convert whatever is out of
+		  * date. Index entries for raw files that have gone away are
+		  * dropped. With setupWatch the directories are also added to
+		  * inotify as they are scanned, so nothing slips in between
+		  * the scan and the watch. Files that fail to convert do not
+		  * make this fail; see failureCount().
+		  */
+		int scan( const bool& setupWatch )
+		{
+		const std::string method = "scan";
+
+			if( -1 == makeParentDirectories( indexFileName ) )
+			{
+				std::cerr << method << " failed to create the output directory " << outputDirectory << std::endl;
+				return -1;
+			}
+
+#ifdef __linux__
+			if( setupWatch == true )
+			{
+				inotifyFd = inotify_init();
+				if( inotifyFd < 0 )
+				{
+					std::cerr << method << " failed on inotify_init: " << strerror( errno ) << std::endl;
+					return -1;
+				}
+			}
+#endif
+
+			loadIndex();
+			rescan();
+
+			std::cerr << "Files to convert: " << pending.size() << std::endl;
+
+			const int ret = runPending();
+			if( -1 == saveIndex() )
+				return -1;
+
+			if( failures != 0 )
+			{
+				std::cerr << method << " failed to convert " << failures << " files." << std::endl;
+			}
+
+		return ret;
+		}
+
+		/**
+		  * The number of files that failed to convert so far.
+		  */
+		unsigned long long failureCount() const
+		{
+			return failures;
+		}
+
+#ifdef __linux__
+		/**
+		  * Written to by the SIGCHLD handler so that a finished worker
+		  * wakes the watch loop.
+		  */
+		static int childPipe[ 2 ];
+
+		static void childExited( int )
+		{
+			const int savedErrno = errno;
+			const ssize_t written = write( childPipe[ 1 ], "", 1 );
+			static_cast< void >( written );
+			errno = savedErrno;
+		}
+
+		/**
+		  * Forget a directory that was removed or moved out of the
+		  * input tree: the index entries below it and its watches.
+		  */
+		void forgetDirectory( const std::string& relativeDirectory )
+		{
+			const std::string prefix = relativeDirectory + FWD_SLASH;
+			for( indexMap::iterator it = index.lower_bound( prefix ); it != index.end() && it->first.compare( 0, prefix.length(), prefix ) == 0; )
+			{
+				journalRemoval( it->first );
+				index.erase( it++ );
+			}
+
+			for( std::map< int, std::string >::iterator it = watches.begin(); it != watches.end(); )
+			{
+				if( it->second == relativeDirectory || it->second.compare( 0, prefix.length(), prefix ) == 0 )
+				{
+					inotify_rm_watch( inotifyFd, it->first );
+					watches.erase( it++ );
+				}
+				else
+					++it;
+			}
+		}
+
+		/**
+		  * Read the waiting inotify events and act on them. If the
+		  * kernel queue overflowed events have been lost, so the whole
+		  * tree is scanned again.
+		  */
+		int readEvents( std::vector< char >& buffer )
+		{
+		const std::string method = "readEvents";
+
+			const ssize_t length = read( inotifyFd, &buffer[ 0 ], buffer.size() );
+			if( length < 0 )
+			{
+				if( errno == EINTR || errno == EAGAIN )
+					return 0;
+				std::cerr << method << " failed to read inotify events: " << strerror( errno ) << std::endl;
+				return -1;
+			}
+
+			bool overflow = false;
+			for( ssize_t pos = 0; pos < length; )
+			{
+				const struct inotify_event* event = reinterpret_cast< const struct inotify_event* >( &buffer[ pos ] );
+				pos += sizeof( struct inotify_event ) + event->len;
+
+				if( event->mask & IN_Q_OVERFLOW )
+				{
+					overflow = true;
+					continue;
+				}
+
+				if( event->mask & IN_IGNORED )
+				{
+					watches.erase( event->wd );
+					continue;
+				}
+
+				std::map< int, std::string >::const_iterator it = watches.find( event->wd );
+				if( it == watches.end() || event->len == 0 || event->name[ 0 ] == '.' )
+					continue;
+
+				const std::string relativePath = it->second.empty() ? std::string( event->name ) : it->second + FWD_SLASH + event->name;
+
+				if( event->mask & IN_ISDIR )
+				{
+					if( event->mask & ( IN_CREATE | IN_MOVED_TO ) )
+						scanTree( relativePath );
+					else if( event->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+						forgetDirectory( relativePath );
+					continue;
+				}
+
+				if( isRawFileName( event->name ) == false )
+					continue;
+
+				if( event->mask & ( IN_DELETE | IN_MOVED_FROM ) )
+				{
+					if( index.erase( relativePath ) != 0 )
+						journalRemoval( relativePath );
+					continue;
+				}
+
+				if( event->mask & ( IN_CLOSE_WRITE | IN_MOVED_TO ) )
+				{
+					struct stat st;
+					const std::string path = inputDirectory + FWD_SLASH + relativePath;
+					if( lstat( path.c_str(), &st ) == 0 && S_ISREG( st.st_mode ) )
+						checkFile( relativePath, st );
+				}
+			}
+
+			if( overflow == true )
+			{
+				std::cerr << method << " the inotify queue overflowed, scanning the whole tree again." << std::endl;
+				rescan();
+			}
+
+		return 0;
+		}
+
+		/**
+		  * Convert files as they are written or moved into the input
+		  * tree. Events keep being read while the workers run so the
+		  * kernel queue does not fill up during a heavy ingest. This
+		  * only returns on error.
+		  */
+		int watch()
+		{
+		const std::string method = "watch";
+
+			retryKilled = true;
+
+			if( pipe( childPipe ) != 0 )
+			{
+				std::cerr << method << " failed on pipe: " << strerror( errno ) << std::endl;
+				return -1;
+			}
+			fcntl( childPipe[ 0 ], F_SETFL, O_NONBLOCK );
+			fcntl( childPipe[ 1 ], F_SETFL, O_NONBLOCK );
+
+			struct sigaction sa;
+			memset( &sa, 0, sizeof( sa ) );
+			sa.sa_handler = childExited;
+			sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+			sigemptyset( &sa.sa_mask );
+			sigaction( SIGCHLD, &sa, NULL );
+
+			std::vector< char > buffer( 64 * ( sizeof( struct inotify_event ) + NAME_MAX + 1 ) );
+			for( ;; )
+			{
+				if( -1 == startWorkers() )
+				{
+					std::cerr << method << " will try starting the worker again." << std::endl;
+				}
+
+				struct pollfd pfd[ 2 ];
+				pfd[ 0 ].fd = inotifyFd;
+				pfd[ 1 ].fd = childPipe[ 0 ];
+				pfd[ 0 ].events = pfd[ 1 ].events = POLLIN;
+				pfd[ 0 ].revents = pfd[ 1 ].revents = 0;
+				const int ready = poll( pfd, 2, -1 );
+				if( ready < 0 && errno != EINTR )
+				{
+					std::cerr << method << " failed on poll: " << strerror( errno ) << std::endl;
+					return -1;
+				}
+
+				/**
+				  * Collect every worker that has finished.
+				  */
+				char drain[ 64 ];
+				while( read( childPipe[ 0 ], drain, sizeof( drain ) ) > 0 )
+					continue;
+				while( reapWorker( false ) == 1 )
+					continue;
+
+				if( ready > 0 && ( pfd[ 0 ].revents & POLLIN ) )
+				{
+					if( -1 == readEvents( buffer ) )
+						return -1;
+				}
+
+				/**
+				  * Fold the journal back into the index once it has
+				  * grown as large as the index itself.
+				  */
+				if( journalLines > index.size() )
+				{
+					saveIndex();
+				}
+			}
+
+		return 0;
+		}
+#endif
+};
+
+#ifdef __linux__
+int directoryConverter::childPipe[ 2 ] = { -1, -1 };
+#endif
+
+int main( int argc, char *argv[] )
+{
+const std::string method = argv[0];
+
+	if( argc < 8 )
+	{
+		std::cerr << "usage: raw2tiff input_file_name output_file_name crop_box_yes_or_no col_pos_start-(x) row_pos_start-(y) number_cols number_rows [-stats] [-dark dark_tiff] [-flat flat_tiff] [-watch] [-jobs n]" << std::endl;
+		std::cerr << "       input_file_name and output_file_name may both be directories." << std::endl;
+		return 0;
+	}
+
+	/**
+	  * Parse the optional arguments. Everything that changes the
+	  * output also goes into the options signature.
+	  */
+	conversionOptions options;
+	bool wantWatch = false;
+	bool wantJobs = false;
+	unsigned int jobs = 1;
+	if( YES.compare( argv[3] ) == 0 )
+	{
+		for( int i = 3; i < 8; i++ )
+		{
+			options.signature.append( argv[i] ).append( 1, ' ' );
+		}
+	}
+	for( int i = 8; i < argc; i++ )
+	{
+		const std::string option = argv[i];
+		if( option.compare( STATS_OPTION ) == 0 )
+		{
+			options.wantStats = true;
+			options.signature.append( option ).append( 1, ' ' );
+		}
+		else if( option.compare( DARK_OPTION ) == 0 && i + 1 < argc )
+		{
+			if( -1 == options.calibration.loadDarkFrame( argv[++i] ) )
+			{
+				std::cerr << method << " failed to load the dark frame." << std::endl;
+				return -1;
+			}
+			options.signature.append( option ).append( 1, ' ' ).append( fileSignature( argv[i] ) ).append( 1, ' ' );
+		}
+		else if( option.compare( FLAT_OPTION ) == 0 && i + 1 < argc )
+		{
+			if( -1 == options.calibration.loadFlatField( argv[++i] ) )
+			{
+				std::cerr << method << " failed to load the flat field." << std::endl;
+				return -1;
+			}
+			options.signature.append( option ).append( 1, ' ' ).append( fileSignature( argv[i] ) ).append( 1, ' ' );
+		}
+		else if( option.compare( WATCH_OPTION ) == 0 )
+		{
+#ifdef __linux__
+			wantWatch = true;
+#else
+			std::cerr << method << " failed. The -watch option needs inotify, which is only available on Linux." << std::endl;
+			return 0;
+#endif
+		}
+		else if( option.compare( JOBS_OPTION ) == 0 && i + 1 < argc )
+		{
+			stringConverter sc;
+			std::stringstream ss;
+			if( -1 == sc.convertTheString< std::stringstream, unsigned int >( ss, argv[++i], jobs ) || jobs == 0 )
+			{
+				std::cerr << method << " failed. The number of jobs is invalid." << std::endl;
+				return 0;
+			}
+			wantJobs = true;
+		}
+		else
+		{
+			std::cerr << method << " failed. Unknown option " << option << std::endl;
+			return 0;
+		}
+	}
+
+	/**
+	  * Need a consistent timezone.
+	  */
+	putenv ((char*)"TZ=UTC");
+
+	/**
+	  * Start parsing the command line arguments.
+	  */
+	std::string inputFileName = argv[1];
+	const bool inputIsDirectory = isDirectory( inputFileName );
+	if( inputIsDirectory == false && inputFileName.length() < 5 )
+	{
+		std::cerr << method << " failed. The input file name is invalid." << std::endl;
+		return 0;
+	}
+
+	std::string outputFileName = argv[2];
+	if( outputFileName.length() == 0 )
+	{
+		std::cerr << method << " failed. The output file name is invalid." << std::endl;
+		return 0;
+	}
+
+	if( wantWatch == true && inputIsDirectory == false )
+	{
+		std::cerr << method << " failed. The -watch option needs an input directory." << std::endl;
+		return 0;
+	}
+
+	if( wantJobs == true && inputIsDirectory == false )
+	{
+		std::cerr << method << " failed. The -jobs option needs an input directory." << std::endl;
+		return 0;
+	}
+
+	/**
+	  * If you want a cropbox specify and store its dimensions.
+	  * This is the -B option from dcraw_emu.
+	  */
+	stringConverter sc;
+	std::stringstream ss;
+	std::string wantCropBox = argv[3];
+	int ret = 0;
+	if( wantCropBox.compare( YES ) == 0 )
+	{
+		options.wantCropBox = true;
+
+		/**
+		  * Set the starting column number-(x).
+		  */
+		const std::string col_pos_start = argv[4];
+		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, col_pos_start, options.cropbox[ COL_NUMBER_START ] );
+		if( ret == -1 )
+		{
+			std::cerr << method << " failed on convertTheString for the value " << col_pos_start << std::endl;
+			return -1;
+		}
+	
+		const unsigned int colNumberStart = options.cropbox[ COL_NUMBER_START ];
+
+		/**
+		  * Set the the starting row number-(y).
+		  */
+		const std::string row_pos_start = argv[5];
+		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, row_pos_start, options.cropbox[ ROW_NUMBER_START ] );
+		if( ret == -1 )
+		{
+			std::cerr << method << " failed on convertStringToUnsignedInt for the value " << row_pos_start << std::endl;
+			return -1;
+		}
+
+		const unsigned int rowNumberStart = options.cropbox[ ROW_NUMBER_START ];
+
+		/**
+		  * Set the number of columns.
+		  */
+		const std::string numberOfCols = argv[6];
+		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, numberOfCols, options.cropbox[ NUMBER_OF_COLS ] );
+		if( ret == -1 )
+		{
+			std::cerr << method << " failed on convertStringToUnsignedInt for the value " << numberOfCols << std::endl;
+			return -1;
+		}
+
+		const unsigned int imageWidth = options.cropbox[ NUMBER_OF_COLS ];
+
+		/**
+		  * Set the number of rows.
+		  */
+		const std::string numberOfRows = argv[7];
+		ret = sc.convertTheString< std::stringstream, unsigned int >( ss, numberOfRows, options.cropbox[ NUMBER_OF_ROWS ] );
+		if( ret == -1 )
+		{
+			std::cerr << method << " failed on convertStringToUnsignedInt for the value " << numberOfRows << std::endl;
+			return -1;
+		}
+
+		const unsigned int imageHeight = options.cropbox[ NUMBER_OF_ROWS ];
+
+		std::cerr << "Crop Box[COL_NUMBER_START]->" << options.cropbox[ 0 ] << std::endl;
+		std::cerr << "Crop Box[ROW_NUMBER_START]->" << options.cropbox[ 1 ] << std::endl;
+		std::cerr << "Crop Box[NUMBER_OF_COLS]->" << options.cropbox[ 2 ] << std::endl;
+		std::cerr << "Crop Box[NUMBER_OF_ROWS]->" << options.cropbox[ 3 ] << std::endl;
+
+	}
+
+	/**
+	  * Convert a whole directory tree, or just the one file.
+	  */
+	if( inputIsDirectory == true )
+	{
+		directoryConverter converter( inputFileName, outputFileName, options, jobs );
+		ret = converter.scan( wantWatch );
+#ifdef __linux__
+		if( ret == 0 && wantWatch == true )
+		{
+			ret = converter.watch();
+		}
+#endif
+		if( ret == 0 && converter.failureCount() != 0 )
+		{
+			ret = 1;
+		}
+		return ret;
+	}
+
+return convertRawFile( inputFileName, outputFileName, options );
 }